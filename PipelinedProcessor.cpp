@@ -1,18 +1,76 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <string>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
 
 #define ICACHE_FILE   "input/ICache.txt"
 #define DCACHE_FILE   "input/DCache.txt"
 #define REGISTER_FILE "input/RF.txt"
 #define ODCACHE_FILE  "output/ODCache.txt"
 #define STATS_FILE    "output/Output.txt"
+#define STAGE_STATS_FILE "output/StageStats.txt"
+#define ENERGY_FILE   "input/Energy.txt"
+#define POWER_FILE    "output/Power.txt"
+#define PROFILE_FILE  "output/Profile.txt"
 
 const int NUM_REGISTERS = 16;
 const int NUM_SETS = 64;
 const int BLOCK_SIZE = 4;
 
-int totalInstructions, arithmeticInstructions, logicalInstructions, dataInstructions,
+long long totalInstructions, arithmeticInstructions, logicalInstructions, dataInstructions,
     controlInstructions, haltInstructions, cycles, stalls, dataStalls;
+
+struct Statistics
+{
+    long long cycles, totalInstructions, arithmeticInstructions, logicalInstructions, dataInstructions,
+        controlInstructions, haltInstructions, stalls, dataStalls, controlStalls;
+    double cyclesPerInstruction;
+};
+
+// What a pipeline stage did in a cycle: useful work, or no work because of a RAW hazard, an unresolved branch or a
+// decoded HALT, either its own or one that left a bubble in an earlier stage. BUBBLE is an empty slot with no such
+// cause (pipeline fill).
+enum StageState
+{
+    BUSY,
+    BUBBLE,
+    DATA_STALL,
+    CONTROL_STALL,
+    HALT_STALL,
+    NUM_STAGE_STATES
+};
+
+// An empty slot is charged to the stall that emptied it upstream; with no such stall (pipeline fill) it is a plain
+// bubble.
+int bubbleCause(int upstreamState) { return upstreamState == BUSY ? BUBBLE : upstreamState; }
+
+const int NUM_STAGES = 5;
+const int NUM_RUN_BUCKETS = 8;
+const char *const STAGE_NAMES[NUM_STAGES] = {"Fetch", "Decode", "Execute", "Memory", "Writeback"};
+
+// Bucket i of runHistogram counts runs of consecutive non-busy cycles of length 2^(i-1)+1 to 2^i, the last bucket
+// everything longer.
+struct StageStatistics
+{
+    long long cycles[NUM_STAGE_STATES];
+    long long runHistogram[NUM_RUN_BUCKETS];
+    long long runLength;
+
+    void recordRun()
+    {
+        int bucket = 0;
+        while (bucket < NUM_RUN_BUCKETS - 1 && (1 << bucket) < runLength)
+            ++bucket;
+        ++runHistogram[bucket];
+        runLength = 0;
+    }
+};
+
+typedef void (*StatisticsCallback)(const Statistics &stats, void *context);
+
 struct set
 {
     int offset[BLOCK_SIZE];
@@ -21,9 +79,16 @@ struct set
 class Cache
 {
 protected:
-    set block[NUM_SETS];
+    set storage[NUM_SETS];
+    set *block;
 
 public:
+    Cache() : block(storage) {}
+
+    // Backs the cache with caller-owned memory of NUM_SETS * BLOCK_SIZE entries (one byte per entry) instead of
+    // the internal storage; passing a null pointer switches back to the internal storage.
+    void attach(int *memory) { block = memory ? reinterpret_cast<set *>(memory) : storage; }
+
     virtual int read(int address) = 0;
     virtual void write(int address, int data) = 0;
 };
@@ -127,13 +192,21 @@ RegisterFile RF;
 class FetchDecodeBuffer
 {
 private:
-    bool valid;
-    int instruction;
+    bool valid, taken;
+    int instruction, pc, address, bubbleCause;
 
 public:
-    FetchDecodeBuffer() : valid(false) {}
+    FetchDecodeBuffer() : valid(false), bubbleCause(BUBBLE) {}
     int getInstruction() { return instruction; }
     void setInstruction(int newInstruction) { instruction = newInstruction; }
+    int getPC() { return pc; }
+    void setPC(int newPC) { pc = newPC; }
+    int getAddress() { return address; }
+    void setAddress(int newAddress) { address = newAddress; }
+    bool getTaken() { return taken; }
+    void setTaken(bool newTaken) { taken = newTaken; }
+    int getBubbleCause() { return bubbleCause; }
+    void setBubbleCause(int newBubbleCause) { bubbleCause = newBubbleCause; }
     bool checkValid() { return valid; }
     void setValid(bool newValid) { valid = newValid; }
 };
@@ -149,15 +222,96 @@ enum
     HALT = 15
 };
 
+const int NUM_OPCODES = 16;
+const char *const MNEMONICS[NUM_OPCODES] = {"ADD", "SUB", "MUL", "INC", "AND", "OR", "NOT", "XOR",
+                                            "LD", "ST", "JMP", "BEQZ", "?", "?", "?", "HLT"};
+
+enum ActivityEvent
+{
+    RF_READ,
+    RF_WRITE,
+    ICACHE_READ,
+    DCACHE_READ,
+    DCACHE_WRITE,
+    LATCH_UPDATE,
+    SQUASH,
+    NUM_ACTIVITY_EVENTS
+};
+
+const char *const ACTIVITY_NAMES[NUM_ACTIVITY_EVENTS] = {"rf_read", "rf_write", "icache_read", "dcache_read",
+                                                         "dcache_write", "latch_update", "squash"};
+
+// Switching activity of the datapath. Stages add to these unconditionally, so counting never branches.
+struct Activity
+{
+    long long events[NUM_ACTIVITY_EVENTS];
+    long long aluOperations[NUM_OPCODES];
+};
+
+Activity activity;
+
+// Energy per event in pJ, keyed in ENERGY_FILE by the activity names and by "alu_" plus the lower-case mnemonic,
+// one "name value" pair per line; clock_mhz sets the frequency used to turn energy into power.
+struct EnergyTable
+{
+    double event[NUM_ACTIVITY_EVENTS];
+    double aluOperation[NUM_OPCODES];
+    double clockMHz;
+
+    EnergyTable() : clockMHz(1000)
+    {
+        const double defaultEvents[NUM_ACTIVITY_EVENTS] = {1.0, 1.2, 5.0, 6.0, 7.0, 0.3, 0.5};
+        const double defaultOperations[NUM_OPCODES] = {0.5, 0.5, 3.0, 0.4, 0.2, 0.2, 0.1, 0.2,
+                                                       0.5, 0.5, 0.5, 0.1, 0, 0, 0, 0};
+
+        for (int i = 0; i < NUM_ACTIVITY_EVENTS; i++)
+            event[i] = defaultEvents[i];
+        for (int i = 0; i < NUM_OPCODES; i++)
+            aluOperation[i] = defaultOperations[i];
+    }
+
+    // Overrides the entries listed in fileName; returns false if the file cannot be read.
+    bool load(const char *fileName)
+    {
+        std::ifstream input(fileName);
+        std::string name;
+        double value;
+
+        if (!input)
+            return false;
+
+        while (input >> name >> value)
+        {
+            if (name == "clock_mhz")
+                clockMHz = value;
+
+            for (int i = 0; i < NUM_ACTIVITY_EVENTS; i++)
+                if (name == ACTIVITY_NAMES[i])
+                    event[i] = value;
+
+            for (int i = 0; i < NUM_OPCODES; i++)
+            {
+                std::string key = "alu_";
+                for (const char *c = MNEMONICS[i]; *c; c++)
+                    key += (char)(*c - 'A' + 'a');
+                if (name == key)
+                    aluOperation[i] = value;
+            }
+        }
+
+        return true;
+    }
+};
+
 class DecodeExecuteBuffer
 {
 private:
-    bool valid;
+    bool valid, taken;
     int instructionType;
-    int opcode, src1, src2, dest, offset;
+    int opcode, src1, src2, dest, offset, pc, address, bubbleCause;
 
 public:
-    DecodeExecuteBuffer() : valid(false) {}
+    DecodeExecuteBuffer() : valid(false), pc(0), bubbleCause(BUBBLE) {}
 
     int getInstructionType() { return instructionType; }
     void setInstructionType(int newInstructionType) { instructionType = newInstructionType; }
@@ -173,17 +327,25 @@ public:
     void setValid(bool newValid) { valid = newValid; }
     int getOffset() { return offset; }
     void setOffset(int newOffset) { offset = newOffset; }
+    int getPC() { return pc; }
+    void setPC(int newPC) { pc = newPC; }
+    int getAddress() { return address; }
+    void setAddress(int newAddress) { address = newAddress; }
+    bool getTaken() { return taken; }
+    void setTaken(bool newTaken) { taken = newTaken; }
+    int getBubbleCause() { return bubbleCause; }
+    void setBubbleCause(int newBubbleCause) { bubbleCause = newBubbleCause; }
 };
 
 class ExecuteMemoryBuffer
 {
 private:
     bool valid;
-    int instructionType, dest, src;
+    int instructionType, dest, src, pc, bubbleCause;
     Register ALUOutput;
 
 public:
-    ExecuteMemoryBuffer() : valid(false) {}
+    ExecuteMemoryBuffer() : valid(false), pc(0), bubbleCause(BUBBLE) {}
 
     int getInstructionType() { return instructionType; }
     void setInstructionType(int newInstructionType) { instructionType = newInstructionType; }
@@ -191,6 +353,10 @@ public:
     void setDest(int newDest) { dest = newDest; }
     int getSrc() { return src; }
     void setSrc(int newSrc) { src = newSrc; }
+    int getPC() { return pc; }
+    void setPC(int newPC) { pc = newPC; }
+    int getBubbleCause() { return bubbleCause; }
+    void setBubbleCause(int newBubbleCause) { bubbleCause = newBubbleCause; }
     bool checkValid() { return valid; }
     void setValid(bool newValid) { valid = newValid; }
     int getALUOutput() { return ALUOutput.getContent(); }
@@ -201,22 +367,307 @@ class MemoryWriteBackBuffer
 {
 private:
     bool valid;
-    int instructionType, dest;
+    int instructionType, dest, src, pc, bubbleCause;
     Register ALUOutput;
 
 public:
-    MemoryWriteBackBuffer() : valid(false) {}
+    MemoryWriteBackBuffer() : valid(false), bubbleCause(BUBBLE) {}
 
     int getInstructionType() { return instructionType; }
     void setInstructionType(int newInstructionType) { instructionType = newInstructionType; }
     int getDest() { return dest; }
     void setDest(int newDest) { dest = newDest; }
+    int getSrc() { return src; }
+    void setSrc(int newSrc) { src = newSrc; }
+    int getPC() { return pc; }
+    void setPC(int newPC) { pc = newPC; }
+    int getBubbleCause() { return bubbleCause; }
+    void setBubbleCause(int newBubbleCause) { bubbleCause = newBubbleCause; }
     bool checkValid() { return valid; }
     void setValid(bool newValid) { valid = newValid; }
     int getALUOutput() { return ALUOutput.getContent(); }
     void setALUOutput(int newOutput) { ALUOutput.setContent(newOutput); }
 };
 
+// Functional model of the ISA that executes one instruction for every instruction the pipeline retires and checks
+// the retired PC, register write and memory write against it. Registers and data memory are private copies taken
+// when checking is enabled; the instruction image is read from the instruction cache, which is never written.
+class ReferenceModel
+{
+private:
+    int pc, registers[NUM_REGISTERS], memory[NUM_SETS * BLOCK_SIZE];
+
+    int signExtend(int value, int bits) { return value - ((value >> (bits - 1)) & 1) * (1 << bits); }
+
+public:
+    bool diverged;
+    int retired;
+    std::string divergence;
+
+    void load(RegisterFile &registerFile, DataCache &dataCache)
+    {
+        pc = retired = 0;
+        diverged = false;
+        divergence.clear();
+
+        for (int i = 0; i < NUM_REGISTERS; i++)
+            registers[i] = registerFile.readContent(i);
+        for (int i = 0; i < NUM_SETS * BLOCK_SIZE; i++)
+            memory[i] = dataCache.read(i);
+    }
+
+    // Returns false at the first retired instruction that does not match the reference.
+    bool retire(MemoryWriteBackBuffer &instruction, int loadedValue)
+    {
+        pc &= NUM_SETS * BLOCK_SIZE - 1;
+
+        int word = iCache.read(pc), opcode = word >> 12, currentPC = pc;
+        int R1 = (word >> 8) & 0xf, R2 = (word >> 4) & 0xf, R3 = word & 0xf;
+        int writeRegister = (opcode < LOAD) ? R1 : -1, writeValue = 0, storeAddress = -1, storeValue = 0;
+
+        pc += 2;
+
+        switch (opcode)
+        {
+        case 0:
+            writeValue = registers[R2] + registers[R3];
+            break;
+        case 1:
+            writeValue = registers[R2] - registers[R3];
+            break;
+        case 2:
+            writeValue = registers[R2] * registers[R3];
+            break;
+        case 3:
+            writeValue = registers[R1] + 1;
+            break;
+        case 4:
+            writeValue = registers[R2] & registers[R3];
+            break;
+        case 5:
+            writeValue = registers[R2] | registers[R3];
+            break;
+        case 6:
+            writeValue = ~registers[R2];
+            break;
+        case 7:
+            writeValue = registers[R2] ^ registers[R3];
+            break;
+        case LOAD:
+            writeRegister = R1;
+            writeValue = memory[(registers[R2] + R3) & (NUM_SETS * BLOCK_SIZE - 1)];
+            break;
+        case STORE:
+            storeAddress = registers[R2] + R3;
+            storeValue = registers[R1];
+            memory[storeAddress & (NUM_SETS * BLOCK_SIZE - 1)] = storeValue;
+            break;
+        case JMP:
+            pc += signExtend((word >> 4) & 0xff, 8) * 2;
+            break;
+        case BEQZ:
+            if (registers[R1] == 0)
+                pc += signExtend(word & 0xff, 8) * 2;
+            break;
+        }
+
+        int instructionType = instruction.getInstructionType();
+        int value = instructionType == LOAD ? loadedValue : instruction.getALUOutput();
+        bool writesRegister = instructionType == ARITHMETIC || instructionType == LOGICAL || instructionType == LOAD;
+        bool pcMismatch = instruction.getPC() != currentPC;
+        bool registerMismatch = writesRegister != (writeRegister >= 0) || (writesRegister && (instruction.getDest() != writeRegister || value != writeValue));
+        bool memoryMismatch = (instructionType == STORE) != (storeAddress >= 0) || (instructionType == STORE && (instruction.getALUOutput() != storeAddress || instruction.getSrc() != storeValue));
+
+        if (!pcMismatch && !registerMismatch && !memoryMismatch)
+        {
+            if (writeRegister >= 0)
+                registers[writeRegister] = writeValue;
+            ++retired;
+            return true;
+        }
+
+        std::ostringstream message;
+        if (pcMismatch)
+            message << "retired PC " << instruction.getPC() << ", expected " << currentPC;
+        else if (registerMismatch)
+            message << "register write R" << instruction.getDest() << " = " << value << ", expected R" << writeRegister << " = " << writeValue;
+        else
+            message << "memory write M[" << instruction.getALUOutput() << "] = " << instruction.getSrc() << ", expected M[" << storeAddress << "] = " << storeValue;
+
+        diverged = true;
+        divergence = message.str();
+        return false;
+    }
+
+    void dump(std::ostream &output, RegisterFile &registerFile, DataCache &dataCache)
+    {
+        output << std::dec << "Divergence after " << retired << " matching instructions: " << divergence << std::endl;
+        output << "Reg  Pipeline  Reference" << std::endl;
+        for (int i = 0; i < NUM_REGISTERS; i++)
+            output << "R" << i << (i < 10 ? "   " : "  ") << registerFile.readContent(i) << "  " << registers[i] << std::endl;
+
+        output << "Memory  Pipeline  Reference" << std::endl;
+        for (int i = 0; i < NUM_SETS * BLOCK_SIZE; i++)
+            if (dataCache.read(i) != memory[i])
+                output << "M[" << i << "]  " << dataCache.read(i) << "  " << memory[i] << std::endl;
+    }
+};
+
+ReferenceModel *referenceModel;
+
+struct TraceRecord
+{
+    int pc, instruction, address;
+    bool taken;
+};
+
+// Streams a recorded dynamic instruction trace in place of the instruction cache. Each line is one record:
+// "PC INSTRUCTION" in hex, followed by the memory address for LD/ST or the outcome (1 taken, 0 not taken) for BEQZ;
+// blank lines are skipped. Records are read one at a time, so traces of any length run in constant memory; a
+// compressed trace can be fed through a pipe or any decompressing std::istream. The end of the trace is delivered
+// as a HALT, and so is a malformed line, after which error describes it.
+class TraceReader
+{
+private:
+    std::istream *input;
+    TraceRecord current;
+    bool replay;
+    long long lineNumber;
+
+    TraceRecord halt()
+    {
+        current.pc += 2;
+        current.instruction = HALT << 12;
+        return current;
+    }
+
+public:
+    std::string error;
+
+    TraceReader() : input(0), replay(false), lineNumber(0) {}
+
+    void open(std::istream &newInput)
+    {
+        input = &newInput;
+        replay = false;
+        lineNumber = 0;
+        current.pc = 0;
+        error.clear();
+    }
+
+    TraceRecord next()
+    {
+        if (replay)
+        {
+            replay = false;
+            return current;
+        }
+
+        std::string line;
+        do
+        {
+            if (!error.empty() || !std::getline(*input, line))
+                return halt();
+            ++lineNumber;
+        } while (line.find_first_not_of(" \t\r") == std::string::npos);
+
+        std::istringstream fields(line);
+        int pc, instruction, opcode, address = 0, taken = 0;
+        bool valid = (fields >> std::hex >> pc >> instruction) && pc >= 0 && instruction >= 0 && instruction <= 0xffff;
+
+        opcode = valid ? instruction >> 12 : 0;
+        if (valid && (opcode == LOAD || opcode == STORE))
+            valid = (fields >> address) && address >= 0;
+        else if (valid && opcode == BEQZ)
+            valid = (fields >> taken) && (taken == 0 || taken == 1);
+
+        std::string extra;
+        if (!valid || fields >> extra)
+        {
+            std::ostringstream message;
+            message << "malformed trace record at line " << std::dec << lineNumber << ": " << line;
+            error = message.str();
+            return halt();
+        }
+
+        current.pc = pc;
+        current.instruction = instruction;
+        current.address = address;
+        current.taken = taken;
+
+        return current;
+    }
+
+    // Delivers the last record again after its fetch has been squashed.
+    void rewind() { replay = true; }
+};
+
+TraceReader trace;
+bool traceMode;
+
+enum SampleEvent
+{
+    SAMPLE_CYCLES,
+    SAMPLE_INSTRUCTIONS,
+    SAMPLE_RAW_STALLS,
+    SAMPLE_BRANCHES,
+    SAMPLE_MEMORY_ACCESSES,
+    NUM_SAMPLE_EVENTS
+};
+
+const char *const SAMPLE_EVENT_NAMES[NUM_SAMPLE_EVENTS] = {"cycles", "instructions", "raw-stalls", "branches", "memory"};
+const int NUM_SAMPLE_SLOTS = NUM_SETS * BLOCK_SIZE / 2;
+
+// Programmable performance counter: after every period events it takes a sample of the PC of the instruction the
+// event belongs to, the one in the execute/memory buffer for memory accesses and the one in the decode/execute
+// buffer otherwise. Slot i of histogram counts samples at PC 2i; the extra last slot collects PCs outside the
+// instruction cache.
+struct SampleCounter
+{
+    long long period, next;
+    long long histogram[NUM_SAMPLE_SLOTS + 1];
+};
+
+std::string disassemble(int instruction)
+{
+    std::ostringstream text;
+    int opcode = instruction >> 12, R1 = (instruction >> 8) & 0xf, R2 = (instruction >> 4) & 0xf, R3 = instruction & 0xf;
+
+    text << MNEMONICS[opcode];
+    switch (opcode)
+    {
+    case HALT:
+        break;
+
+    case 3:
+        text << " R" << R1;
+        break;
+
+    case 6:
+        text << " R" << R1 << ", R" << R2;
+        break;
+
+    case LOAD:
+    case STORE:
+        text << " R" << R1 << ", R" << R2 << "[" << R3 << "]";
+        break;
+
+    case JMP:
+        text << " " << (int)(signed char)((instruction >> 4) & 0xff);
+        break;
+
+    case BEQZ:
+        text << " R" << R1 << ", " << (int)(signed char)(instruction & 0xff);
+        break;
+
+    default:
+        if (opcode < LOAD)
+            text << " R" << R1 << ", R" << R2 << ", R" << R3;
+    }
+
+    return text.str();
+}
+
 int currHazardousRegisters, prevHazardousRegisters;
 bool stopFetch, branchUndecided, prevBranchUndecided;
 
@@ -225,8 +676,9 @@ class FetchStage
 public:
     FetchDecodeBuffer &bufRight;
     bool stall;
+    int state;
 
-    FetchStage(FetchDecodeBuffer &FDBuf) : stall(false), bufRight(FDBuf) { prevHazardousRegisters = 0; }
+    FetchStage(FetchDecodeBuffer &FDBuf) : stall(false), bufRight(FDBuf), state(BUSY) { prevHazardousRegisters = 0; }
 
     void execute()
     {
@@ -234,12 +686,30 @@ public:
         stall = stall || branchUndecided;
         stall = stall || (currHazardousRegisters > 0);
 
+        state = stopFetch ? HALT_STALL : branchUndecided ? CONTROL_STALL : stall ? DATA_STALL : BUSY;
+
         bufRight.setValid(!stall);
+        bufRight.setBubbleCause(state);
 
         if (!stall)
         {
+            if (traceMode)
+            {
+                TraceRecord record = trace.next();
+                PC.write(record.pc);
+                bufRight.setInstruction(record.instruction);
+                bufRight.setAddress(record.address);
+                bufRight.setTaken(record.taken);
+            }
+            else
+            {
+                // A PC that runs off either end of the instruction image wraps around, like the address bits would.
+                PC.write(PC.read() & (NUM_SETS * BLOCK_SIZE - 1));
+                bufRight.setInstruction(iCache.read(PC.read()));
+            }
 
-            bufRight.setInstruction(iCache.read(PC.read()));
+            ++activity.events[ICACHE_READ];
+            bufRight.setPC(PC.read());
             IR.setContent(bufRight.getInstruction());
             PC.increment();
             stall = false;
@@ -257,21 +727,34 @@ public:
     FetchDecodeBuffer &bufLeft;
     DecodeExecuteBuffer &bufRight;
     bool stall;
+    int state;
 
-    DecodeStage(FetchDecodeBuffer &FDBuf, DecodeExecuteBuffer &DEBuf) : stall(false), bufLeft(FDBuf), bufRight(DEBuf) {}
+    DecodeStage(FetchDecodeBuffer &FDBuf, DecodeExecuteBuffer &DEBuf) : stall(false), bufLeft(FDBuf), bufRight(DEBuf), state(BUBBLE) {}
+
+    // Whatever state decode ends in is also the cause of the bubble it leaves in the decode/execute buffer.
+    void execute()
+    {
+        decode();
+        bufRight.setBubbleCause(state);
+    }
 
-    void execute() 
+    void decode() 
     {
         stall = ((currHazardousRegisters > 0) || branchUndecided || stopFetch || !bufLeft.checkValid());
 
         bufRight.setValid(!stall);
 
+        state = (currHazardousRegisters > 0) ? DATA_STALL : branchUndecided ? CONTROL_STALL : stopFetch ? HALT_STALL : stall ? bubbleCause(bufLeft.getBubbleCause()) : BUSY;
+
         if (stall)
             return;
 
         int instruction = bufLeft.getInstruction(), opcode = instruction >> 12;
         bufRight.setOpcode(opcode);
         bufRight.setInstructionType(opcode); 
+        bufRight.setPC(bufLeft.getPC());
+        bufRight.setAddress(bufLeft.getAddress());
+        bufRight.setTaken(bufLeft.getTaken());
 
         switch (opcode)
         {
@@ -291,12 +774,14 @@ public:
             {
                 branchUndecided = true;
                 bufRight.setSrc1(RF.readContent(R1));
+                ++activity.events[RF_READ];
                 bufRight.setOffset(instruction & 0xff);
             }
             else
             {
                 RF.setDataHazard(R1, true);
                 ++currHazardousRegisters;
+                state = DATA_STALL;
             }
             break;
         }
@@ -319,13 +804,16 @@ public:
             {
                 bufRight.setSrc1(RF.readContent(R1));
                 bufRight.setSrc2(RF.readContent(R2));
+                activity.events[RF_READ] += 2;
                 bufRight.setDest(instruction & 0xf);
+                bufRight.setOffset(instruction & 0xf);
             }
             else
             {
                 RF.setDataHazard(R1, !RF.checkValid(R1));
                 RF.setDataHazard(R2, !RF.checkValid(R2));
                 currHazardousRegisters += !RF.checkValid(R1) + !RF.checkValid(R2) - (R1 == R2);
+                state = DATA_STALL;
             }
             break;
         }
@@ -341,12 +829,14 @@ public:
                 bufRight.setSrc1(R1);
                 RF.setValid(R1, false);
                 bufRight.setSrc2(RF.readContent(R2));
+                ++activity.events[RF_READ];
                 bufRight.setOffset(instruction & 0xf);
             }
             else
             {
                 RF.setDataHazard(R2, true);
                 ++currHazardousRegisters;
+                state = DATA_STALL;
             }
             break;
         }
@@ -370,6 +860,7 @@ public:
                 {
                     bufRight.setSrc1(RF.readContent(R2));
                     bufRight.setSrc2(RF.readContent(R3));
+                    activity.events[RF_READ] += 2;
                     bufRight.setDest(R1);
                     RF.setValid(R1, false);
                 }
@@ -378,6 +869,7 @@ public:
                     RF.setDataHazard(R2, !RF.checkValid(R2));
                     RF.setDataHazard(R3, !RF.checkValid(R3));
                     currHazardousRegisters += !RF.checkValid(R2) + !RF.checkValid(R3) - (R2 == R3);
+                    state = DATA_STALL;
                 }
             }
             else
@@ -395,6 +887,7 @@ public:
                         bufRight.setSrc1(RF.readContent(R1));
                     else
                         bufRight.setSrc1(RF.readContent(R2));
+                    ++activity.events[RF_READ];
 
                     bufRight.setDest(R1);
                     RF.setValid(R1, false);
@@ -407,6 +900,7 @@ public:
                         RF.setDataHazard(R2, true);
 
                     ++currHazardousRegisters;
+                    state = DATA_STALL;
                 }
             }
         }
@@ -420,25 +914,57 @@ public:
     DecodeExecuteBuffer &bufLeft;
     ExecuteMemoryBuffer &bufRight;
     bool stall;
+    int state;
 
-    ExecuteStage(DecodeExecuteBuffer &DEBuf, ExecuteMemoryBuffer &EMBuf) : stall(false), bufLeft(DEBuf), bufRight(EMBuf) {}
+    ExecuteStage(DecodeExecuteBuffer &DEBuf, ExecuteMemoryBuffer &EMBuf) : stall(false), bufLeft(DEBuf), bufRight(EMBuf), state(BUBBLE) {}
 
     int signExtendAddress(int address)
     {
         bool neg = address >> 7;
-        return address - neg ? 256 : 0;
+        return address - (neg ? 256 : 0);
     }
 
     int signExtendOffset(int offset)
     {
         bool neg = offset >> 3;
-        return offset - neg ? 16 : 0;
+        return offset - (neg ? 16 : 0);
+    }
+
+    // Trace-driven execution: operands and results are not computed, only branch resolution and the recorded memory
+    // address are passed on so the hazard and memory timing stay the same.
+    void executeTimingOnly(int instructionType)
+    {
+        switch (instructionType)
+        {
+        case BEQZ:
+        case JMP:
+            bufRight.setALUOutput(bufLeft.getTaken());
+            branchUndecided = false;
+            break;
+
+        case STORE:
+            bufRight.setALUOutput(bufLeft.getAddress());
+            bufRight.setDest(bufLeft.getAddress());
+            break;
+
+        case LOAD:
+            bufRight.setDest(bufLeft.getSrc1());
+            bufRight.setALUOutput(bufLeft.getAddress());
+            break;
+
+        case LOGICAL:
+        case ARITHMETIC:
+            bufRight.setDest(bufLeft.getDest());
+            break;
+        }
     }
 
     void execute()
     {
         stall = !bufLeft.checkValid();
         bufRight.setValid(!stall);
+        state = stall ? bubbleCause(bufLeft.getBubbleCause()) : BUSY;
+        bufRight.setBubbleCause(state);
 
         if (stall)
             return;
@@ -446,7 +972,15 @@ public:
         int instructionType = bufLeft.getInstructionType();
 
         bufRight.setInstructionType(instructionType);
+        bufRight.setPC(bufLeft.getPC());
         int opcode = bufLeft.getOpcode();
+        activity.aluOperations[opcode] += opcode != HALT;
+
+        if (traceMode)
+        {
+            executeTimingOnly(instructionType);
+            return;
+        }
 
         switch (instructionType)
         {
@@ -460,7 +994,7 @@ public:
             bool condition = ALU.BEQZ(bufLeft.getSrc1());
             if (condition)
             {
-                int byteOffset = signExtendAddress(bufLeft.getOffset() << 1), newAddress = ALU.ADD(PC.read(), byteOffset);
+                int byteOffset = signExtendAddress(bufLeft.getOffset()) * 2, newAddress = ALU.ADD(PC.read(), byteOffset);
                 bufRight.setALUOutput(newAddress);
                 PC.write(newAddress);
             }
@@ -469,7 +1003,7 @@ public:
         }
         case JMP:
         {
-            int byteOffset = signExtendAddress(bufLeft.getOffset() << 1), newAddress = ALU.ADD(PC.read(), byteOffset);
+            int byteOffset = signExtendAddress(bufLeft.getOffset()) * 2, newAddress = ALU.ADD(PC.read(), byteOffset);
             bufRight.setALUOutput(newAddress);
             PC.write(newAddress);
             branchUndecided = false;
@@ -545,15 +1079,18 @@ class MemoryStage
 {
 public:
     bool stall;
+    int state;
     ExecuteMemoryBuffer &bufLeft;
     MemoryWriteBackBuffer &bufRight;
     Register &LMD;
 
-    MemoryStage(ExecuteMemoryBuffer &EMBuf, MemoryWriteBackBuffer &MWBBuf, Register &LMD) : stall(false), bufLeft(EMBuf), bufRight(MWBBuf), LMD(LMD) {}
+    MemoryStage(ExecuteMemoryBuffer &EMBuf, MemoryWriteBackBuffer &MWBBuf, Register &LMD) : stall(false), state(BUBBLE), bufLeft(EMBuf), bufRight(MWBBuf), LMD(LMD) {}
     void execute()
     {
         stall = !bufLeft.checkValid();
         bufRight.setValid(!stall);
+        state = stall ? bubbleCause(bufLeft.getBubbleCause()) : BUSY;
+        bufRight.setBubbleCause(state);
 
         if (stall)
             return;
@@ -561,7 +1098,10 @@ public:
         int instructionType = bufLeft.getInstructionType();
         bufRight.setInstructionType(instructionType);
 
-        switch (instructionType)
+        activity.events[DCACHE_READ] += instructionType == LOAD;
+        activity.events[DCACHE_WRITE] += instructionType == STORE;
+
+        switch (traceMode ? -1 : instructionType)
         {
         case LOAD:
         {
@@ -577,6 +1117,8 @@ public:
         }
 
         bufRight.setDest(bufLeft.getDest());
+        bufRight.setSrc(bufLeft.getSrc());
+        bufRight.setPC(bufLeft.getPC());
         bufRight.setALUOutput(bufLeft.getALUOutput());
     }
 };
@@ -585,20 +1127,28 @@ class WritebackStage
 {
 public:
     bool stall, &halt;
+    int state;
     Register &LMD;
     MemoryWriteBackBuffer &bufLeft;
 
-    WritebackStage(Register &LMD, MemoryWriteBackBuffer &MWBBuf, bool &halt) : stall(false), LMD(LMD), bufLeft(MWBBuf), halt(halt) {}
+    WritebackStage(Register &LMD, MemoryWriteBackBuffer &MWBBuf, bool &halt) : stall(false), halt(halt), state(BUBBLE), LMD(LMD), bufLeft(MWBBuf) {}
 
     void execute()
     {
         stall = !bufLeft.checkValid();
+        state = stall ? bubbleCause(bufLeft.getBubbleCause()) : BUSY;
 
         if (stall)
             return;
 
         int instructionType = bufLeft.getInstructionType();
 
+        if (referenceModel && !referenceModel->retire(bufLeft, LMD.getContent()))
+        {
+            halt = true;
+            return;
+        }
+
         switch (instructionType)
         {
 
@@ -610,7 +1160,9 @@ public:
                 --currHazardousRegisters;
             }
             RF.setValid(bufLeft.getDest(), true);
-            RF.writeContent(bufLeft.getDest(), LMD.getContent());
+            ++activity.events[RF_WRITE];
+            if (!traceMode)
+                RF.writeContent(bufLeft.getDest(), LMD.getContent());
 
             break;
         }
@@ -624,7 +1176,9 @@ public:
                 --currHazardousRegisters;
             }
             RF.setValid(bufLeft.getDest(), true);
-            RF.writeContent(bufLeft.getDest(), bufLeft.getALUOutput());
+            ++activity.events[RF_WRITE];
+            if (!traceMode)
+                RF.writeContent(bufLeft.getDest(), bufLeft.getALUOutput());
             break;
         }
 
@@ -655,10 +1209,30 @@ public:
 
     bool halt;
 
+    StatisticsCallback statsCallback;
+    void *statsContext;
+    long long statsInterval;
+
+    long long maxCycles, maxInstructions;
+    double timeLimit;
+    const char *terminationReason;
+
+    StageStatistics stageStats[NUM_STAGES];
+
+    ReferenceModel reference;
+
+    EnergyTable energyTable;
+
+    SampleCounter samplers[NUM_SAMPLE_EVENTS];
+    bool sampling;
+
     PipelinedProcessor() : fetchStage(FDBuf_left), decodeStage(FDBuf_right, DEBuf_left), executeStage(DEBuf_right, EMBuf_left), memoryStage(EMBuf_right, MWBBuf_left, LMD_left), writebackStage(LMD_right, MWBBuf_right, halt)
     {
         std::ifstream instructionInput(ICACHE_FILE), dataInput(DCACHE_FILE), registerFile(REGISTER_FILE);
 
+        iCache.attach(0);
+        dCache.attach(0);
+
         int Byte1, Byte2, address = 0;
 
         while (instructionInput >> std::hex >> Byte1)
@@ -675,21 +1249,57 @@ public:
             ++address;
         }
 
+        int registers[NUM_REGISTERS];
+        for (int i = 0; i < NUM_REGISTERS; i++)
+            registerFile >> std::hex >> registers[i];
+
+        reset(registers);
+        energyTable.load(ENERGY_FILE);
+    }
+
+    // Embedding entry point: the caches run directly on the caller's instruction and data images, each holding
+    // NUM_SETS * BLOCK_SIZE entries with one byte per entry (the layout of ICache.txt and DCache.txt). Both images
+    // must outlive the simulator; stores are visible in dataMemory as they happen. The simulator state is global,
+    // so only one instance may be live at a time.
+    PipelinedProcessor(int *instructionMemory, int *dataMemory, const int *registers) : fetchStage(FDBuf_left), decodeStage(FDBuf_right, DEBuf_left), executeStage(DEBuf_right, EMBuf_left), memoryStage(EMBuf_right, MWBBuf_left, LMD_left), writebackStage(LMD_right, MWBBuf_right, halt)
+    {
+        iCache.attach(instructionMemory);
+        dCache.attach(dataMemory);
+
+        reset(registers);
+    }
+
+    void reset(const int *registers)
+    {
         for (int i = 0; i < NUM_REGISTERS; i++)
         {
-            int input;
-            registerFile >> std::hex >> input;
-            RF.writeContent(i, input);
+            RF.writeContent(i, registers[i]);
             RF.setValid(i, true);
             RF.setDataHazard(i, false);
         }
 
         totalInstructions = arithmeticInstructions = logicalInstructions = dataInstructions = controlInstructions = haltInstructions = dataStalls = 0;
         cycles = 1;
-        stalls = -4;
+        stalls = -2;
 
+        PC.write(0);
         currHazardousRegisters = prevHazardousRegisters = 0;
-        branchUndecided = halt = stopFetch = false;
+        branchUndecided = prevBranchUndecided = halt = stopFetch = false;
+        traceMode = false;
+        referenceModel = 0;
+
+        statsCallback = 0;
+        statsContext = 0;
+        statsInterval = 0;
+
+        maxCycles = maxInstructions = 0;
+        timeLimit = 0;
+        terminationReason = 0;
+
+        std::memset(stageStats, 0, sizeof(stageStats));
+        std::memset(&activity, 0, sizeof(activity));
+        std::memset(samplers, 0, sizeof(samplers));
+        sampling = false;
     }
 
     void executeCycle()
@@ -718,32 +1328,207 @@ public:
         DEBuf_right = DEBuf_left;
         EMBuf_right = EMBuf_left;
         MWBBuf_right = MWBBuf_left;
+
+        activity.events[LATCH_UPDATE] += FDBuf_right.checkValid() + DEBuf_right.checkValid() + EMBuf_right.checkValid() + MWBBuf_right.checkValid();
     }
 
     void flushFetch()
     {
         FDBuf_left.setValid(false);
         PC.decrement();
+        ++activity.events[SQUASH];
+        FDBuf_left.setBubbleCause(CONTROL_STALL);
+        fetchStage.state = CONTROL_STALL;
+        if (traceMode)
+            trace.rewind();
     }
 
+    void tick()
+    {
+        cycles++;
+        DecodeExecuteBuffer DEBuf = executeStage.bufLeft;
+        int memoryPC = memoryStage.bufLeft.getPC();
+        executeCycle();
+        reviseStats(DEBuf);
+        reviseStageStats();
+
+        if (sampling)
+            takeSamples(DEBuf.getPC(), memoryPC);
+
+        if (traceMode && !trace.error.empty() && !terminationReason)
+        {
+            terminationReason = "malformed trace";
+            std::cerr << trace.error << std::endl;
+        }
+
+        if (referenceModel && referenceModel->diverged && !terminationReason)
+        {
+            terminationReason = "divergence from reference model";
+            referenceModel->dump(std::cerr, RF, dCache);
+        }
+
+        if (statsCallback && (cycles - 1) % statsInterval == 0)
+            statsCallback(getStatistics(), statsContext);
+    }
+
+    // Runs until HALT or until a budget set by setBudget() is exhausted, in which case terminationReason says which
+    // one and the state reflects the partial run. The wall clock is only sampled every 1024 cycles.
     void simulate()
     {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
         while (!halt)
         {
-            cycles++;
-            DecodeExecuteBuffer DEBuf = executeStage.bufLeft;
-            executeCycle();
-            reviseStats(DEBuf);
+            if (maxCycles && cycles - 1 >= maxCycles)
+            {
+                terminationReason = "cycle budget exhausted";
+                break;
+            }
+
+            if (maxInstructions && totalInstructions >= maxInstructions)
+            {
+                terminationReason = "instruction budget exhausted";
+                break;
+            }
+
+            if (timeLimit > 0 && !(cycles & 1023) && std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() >= timeLimit)
+            {
+                terminationReason = "timeout";
+                break;
+            }
+
+            tick();
+        }
+    }
+
+    // Switches to trace-driven timing: instructions come from input instead of the instruction cache and no
+    // functional results are computed, so the register file and data cache are left as loaded. There is nothing
+    // for the reference model to check against, so this turns the checker off.
+    void useTrace(std::istream &input)
+    {
+        trace.open(input);
+        traceMode = true;
+        referenceModel = 0;
+    }
+
+    // Checks every retired instruction against a reference interpreter started from the current register and
+    // data cache contents; the first mismatch halts the run with a state dump on stderr. Not available with traces.
+    void enableChecker()
+    {
+        reference.load(RF, dCache);
+        referenceModel = traceMode ? 0 : &reference;
+    }
+
+    // Samples the PC every period occurrences of event; a period of zero turns the counter off. Unknown events and
+    // negative periods are ignored.
+    void setSamplePeriod(int event, long long period)
+    {
+        if (event < 0 || event >= NUM_SAMPLE_EVENTS || period < 0)
+            return;
+
+        long long counts[NUM_SAMPLE_EVENTS];
+        readSampleEvents(counts);
+
+        samplers[event].period = period;
+        samplers[event].next = counts[event] + period;
+
+        sampling = false;
+        for (int i = 0; i < NUM_SAMPLE_EVENTS; i++)
+            sampling = sampling || samplers[i].period > 0;
+    }
+
+    // Instructions are counted as they leave decode/execute; nothing after that point is squashed, so each of them
+    // retires.
+    void readSampleEvents(long long *counts)
+    {
+        counts[SAMPLE_CYCLES] = cycles - 1;
+        counts[SAMPLE_INSTRUCTIONS] = totalInstructions;
+        counts[SAMPLE_RAW_STALLS] = dataStalls;
+        counts[SAMPLE_BRANCHES] = activity.aluOperations[JMP] + activity.aluOperations[BEQZ];
+        counts[SAMPLE_MEMORY_ACCESSES] = activity.events[DCACHE_READ] + activity.events[DCACHE_WRITE];
+    }
+
+    // executePC and memoryPC are the instructions in the decode/execute and execute/memory buffers at the start of
+    // the cycle, i.e. the ones executing and accessing memory in it. RAW stalls leave the decode/execute buffer
+    // empty, so they are charged to the last instruction issued before the stall.
+    void takeSamples(int executePC, int memoryPC)
+    {
+        long long counts[NUM_SAMPLE_EVENTS];
+        readSampleEvents(counts);
+
+        for (int i = 0; i < NUM_SAMPLE_EVENTS; i++)
+        {
+            SampleCounter &sampler = samplers[i];
+            int pc = i == SAMPLE_MEMORY_ACCESSES ? memoryPC : executePC;
+            int slot = (pc >= 0 && pc < NUM_SETS * BLOCK_SIZE) ? pc >> 1 : NUM_SAMPLE_SLOTS;
+
+            while (sampler.period && counts[i] >= sampler.next)
+            {
+                ++sampler.histogram[slot];
+                sampler.next += sampler.period;
+            }
         }
     }
 
+    // Limits simulate() to numCycles cycles, numInstructions executed instructions and seconds of wall-clock time;
+    // zero leaves the corresponding limit off.
+    void setBudget(long long numCycles, long long numInstructions, double seconds)
+    {
+        maxCycles = numCycles;
+        maxInstructions = numInstructions;
+        timeLimit = seconds;
+    }
+
+    // Advances at most numCycles cycles, stopping early on HALT; returns the number of cycles executed.
+    long long step(long long numCycles)
+    {
+        long long executed = 0;
+        for (; executed < numCycles && !halt; executed++)
+            tick();
+        return executed;
+    }
+
+    // Calls callback with a statistics snapshot every interval cycles; a null callback disables it.
+    void setStatisticsCallback(StatisticsCallback callback, void *context, long long interval)
+    {
+        statsCallback = interval > 0 ? callback : 0;
+        statsContext = context;
+        statsInterval = interval;
+    }
+
+    bool hasHalted() { return halt; }
+    int readProgramCounter() { return PC.read(); }
+    int readRegister(int index) { return RF.readContent(index); }
+    int readData(int address) { return dCache.read(address); }
+
+    Statistics getStatistics()
+    {
+        Statistics stats;
+
+        stats.cycles = cycles - 1;
+        stats.totalInstructions = totalInstructions;
+        stats.arithmeticInstructions = arithmeticInstructions;
+        stats.logicalInstructions = logicalInstructions;
+        stats.dataInstructions = dataInstructions;
+        stats.controlInstructions = controlInstructions;
+        stats.haltInstructions = haltInstructions;
+        stats.stalls = stalls > 0 ? stalls : 0;
+        stats.dataStalls = dataStalls;
+        stats.controlStalls = stats.stalls > dataStalls ? stats.stalls - dataStalls : 0;
+        stats.cyclesPerInstruction = totalInstructions ? (double)(cycles - 1) / totalInstructions : 0;
+
+        return stats;
+    }
+
     void reviseStats(DecodeExecuteBuffer DEBuf)
     {
         if (currHazardousRegisters > 0)
             ++dataStalls;
 
+        // Stalls start at -2 to discount the two fill cycles before the first instruction reaches execute; the drain
+        // cycles after HALT has executed are not stalls either.
         if (executeStage.stall)
-            ++stalls;
+            stalls += !haltInstructions;
         else
         {
             ++totalInstructions;
@@ -774,6 +1559,122 @@ public:
         }
     }
 
+    void reviseStageStats()
+    {
+        int states[NUM_STAGES] = {fetchStage.state, decodeStage.state, executeStage.state, memoryStage.state, writebackStage.state};
+
+        for (int i = 0; i < NUM_STAGES; i++)
+        {
+            StageStatistics &stage = stageStats[i];
+            ++stage.cycles[states[i]];
+
+            if (states[i] != BUSY)
+                ++stage.runLength;
+            else if (stage.runLength)
+                stage.recordRun();
+        }
+    }
+
+    const StageStatistics &getStageStatistics(int stage) { return stageStats[stage]; }
+
+    void printStageStats()
+    {
+        std::ofstream stageOutput(STAGE_STATS_FILE);
+        long long totalCycles = cycles - 1;
+
+        const char *const columns[NUM_STAGE_STATES] = {"Busy", "Bubble", "Data stalls", "Control stalls", "Halt stalls"};
+        const char *const buckets[NUM_RUN_BUCKETS] = {"1", "2", "3-4", "5-8", "9-16", "17-32", "33-64", "65+"};
+
+        // Every column is preceded by a space, so counts wider than the column stay separated.
+        stageOutput << "Stage     ";
+        for (int state = 0; state < NUM_STAGE_STATES; state++)
+        {
+            stageOutput << ' ';
+            stageOutput.width(14);
+            stageOutput << columns[state];
+        }
+        stageOutput << " Utilization (%)" << std::endl;
+
+        for (int i = 0; i < NUM_STAGES; i++)
+        {
+            const long long *count = stageStats[i].cycles;
+
+            stageOutput.width(10);
+            stageOutput << std::left << STAGE_NAMES[i] << std::right;
+            for (int state = 0; state < NUM_STAGE_STATES; state++)
+            {
+                stageOutput << ' ';
+                stageOutput.width(14);
+                stageOutput << count[state];
+            }
+            stageOutput << ' ';
+            stageOutput.width(15);
+            stageOutput << (totalCycles ? 100.0 * count[BUSY] / totalCycles : 0) << std::endl;
+        }
+
+        stageOutput << std::endl << "Stall-run lengths (consecutive non-busy cycles)" << std::endl;
+        stageOutput << "Stage     ";
+        for (int bucket = 0; bucket < NUM_RUN_BUCKETS; bucket++)
+        {
+            stageOutput << ' ';
+            stageOutput.width(11);
+            stageOutput << buckets[bucket];
+        }
+        stageOutput << std::endl;
+
+        for (int i = 0; i < NUM_STAGES; i++)
+        {
+            StageStatistics stage = stageStats[i];
+            if (stage.runLength)
+                stage.recordRun();
+
+            stageOutput.width(10);
+            stageOutput << std::left << STAGE_NAMES[i] << std::right;
+            for (int bucket = 0; bucket < NUM_RUN_BUCKETS; bucket++)
+            {
+                stageOutput << ' ';
+                stageOutput.width(11);
+                stageOutput << stage.runHistogram[bucket];
+            }
+            stageOutput << std::endl;
+        }
+    }
+
+    void printPower()
+    {
+        std::ofstream powerOutput(POWER_FILE);
+        double energy = 0;
+        long long totalCycles = cycles - 1;
+
+        powerOutput << "Event            Count     Energy (pJ)" << std::endl;
+        for (int i = 0; i < NUM_ACTIVITY_EVENTS + NUM_OPCODES; i++)
+        {
+            bool isEvent = i < NUM_ACTIVITY_EVENTS;
+            long long count = isEvent ? activity.events[i] : activity.aluOperations[i - NUM_ACTIVITY_EVENTS];
+            double eventEnergy = count * (isEvent ? energyTable.event[i] : energyTable.aluOperation[i - NUM_ACTIVITY_EVENTS]);
+
+            if (!isEvent && !count)
+                continue;
+
+            std::string name = isEvent ? ACTIVITY_NAMES[i] : std::string("alu ") + MNEMONICS[i - NUM_ACTIVITY_EVENTS];
+            powerOutput.width(14);
+            powerOutput << std::left << name << std::right;
+            powerOutput.width(8);
+            powerOutput << count;
+            powerOutput.width(16);
+            powerOutput << eventEnergy << std::endl;
+            energy += eventEnergy;
+        }
+
+        double seconds = totalCycles / (energyTable.clockMHz * 1e6);
+
+        powerOutput << std::endl;
+        powerOutput << "Total energy (pJ)                    : " << energy << std::endl;
+        powerOutput << "Average power (mW)                   : " << (seconds > 0 ? energy * 1e-9 / seconds : 0) << std::endl;
+        powerOutput << "Energy per instruction (pJ)          : " << (totalInstructions ? energy / totalInstructions : 0) << std::endl;
+        powerOutput << "Cycles Per Instruction               : " << (totalInstructions ? (double)totalCycles / totalInstructions : 0) << std::endl;
+    }
+
     void printOutputs()
     {
         std::ofstream DCacheOutput(ODCACHE_FILE), statsOutput(STATS_FILE);
@@ -783,6 +1684,8 @@ public:
                 DCacheOutput << std::hex << ((dCache.read(i) & 0xf0)>>4) << (dCache.read(i) & 0xf) << std::endl;
         }
 
+        Statistics stats = getStatistics();
+
         statsOutput << std::dec << "Total number of instructions executed: " << totalInstructions << std::endl;
         statsOutput << std::dec << "Number of instructions in each class" << std::endl;
         statsOutput << std::dec << "Arithmetic instructions              : " << arithmeticInstructions << std::endl;
@@ -790,20 +1693,203 @@ public:
         statsOutput << std::dec << "Data instructions                    : " << dataInstructions << std::endl;
         statsOutput << std::dec << "Control instructions                 : " << controlInstructions << std::endl;
         statsOutput << std::dec << "Halt instructions                    : " << haltInstructions << std::endl;
-        statsOutput << std::dec << "Cycles Per Instruction               : " << (double)(cycles - 1) / totalInstructions << std::endl;
-        statsOutput << std::dec << "Total number of stalls               : " << stalls << std::endl;
+        statsOutput << std::dec << "Cycles Per Instruction               : " << stats.cyclesPerInstruction << std::endl;
+        statsOutput << std::dec << "Total number of stalls               : " << stats.stalls << std::endl;
         statsOutput << std::dec << "Data stalls (RAW)                    : " << dataStalls << std::endl;
-        statsOutput << std::dec << "Control stalls                       : " << stalls - dataStalls << std::endl;
+        statsOutput << std::dec << "Control stalls                       : " << stats.controlStalls << std::endl;
+        if (terminationReason)
+            statsOutput << std::dec << "Terminated early                     : " << terminationReason << std::endl;
 
         DCacheOutput.close();
         statsOutput.close();
+
+        printStageStats();
+        printPower();
+        if (sampling)
+            printProfile();
     }
+
+    void printProfile()
+    {
+        std::ofstream profileOutput(PROFILE_FILE);
+
+        profileOutput << "Sample periods:";
+        for (int i = 0; i < NUM_SAMPLE_EVENTS; i++)
+            if (samplers[i].period)
+                profileOutput << " " << SAMPLE_EVENT_NAMES[i] << "=" << samplers[i].period;
+        profileOutput << std::endl << std::endl;
+
+        profileOutput << "PC    Word  Instruction       ";
+        for (int i = 0; i < NUM_SAMPLE_EVENTS; i++)
+            if (samplers[i].period)
+            {
+                profileOutput.width(13);
+                profileOutput << SAMPLE_EVENT_NAMES[i];
+            }
+        profileOutput << std::endl;
+
+        for (int slot = 0; slot <= NUM_SAMPLE_SLOTS; slot++)
+        {
+            int instruction = slot < NUM_SAMPLE_SLOTS ? iCache.read(slot << 1) : 0;
+            long long samples = 0;
+            for (int i = 0; i < NUM_SAMPLE_EVENTS; i++)
+                samples += samplers[i].histogram[slot];
+
+            if (!instruction && !samples)
+                continue;
+
+            if (slot < NUM_SAMPLE_SLOTS)
+            {
+                std::string text = disassemble(instruction);
+                profileOutput << std::hex;
+                profileOutput.fill('0');
+                profileOutput.width(2);
+                profileOutput << (slot << 1) << "    ";
+                profileOutput.width(4);
+                profileOutput << instruction << "  ";
+                profileOutput.fill(' ');
+                profileOutput.width(18);
+                profileOutput << std::left << text << std::right << std::dec;
+            }
+            else
+                profileOutput << "outside ICache              ";
+
+            for (int i = 0; i < NUM_SAMPLE_EVENTS; i++)
+                if (samplers[i].period)
+                {
+                    profileOutput.width(13);
+                    profileOutput << samplers[i].histogram[slot];
+                }
+            profileOutput << std::endl;
+        }
+    }
+};
+
+struct ProgressStream
+{
+    std::ostream *output;
+    std::chrono::steady_clock::time_point start;
 };
 
-int main()
+void writeProgress(const Statistics &stats, void *context)
 {
+    ProgressStream *progress = (ProgressStream *)context;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - progress->start).count();
+
+    *progress->output << std::dec << "cycles " << stats.cycles << " instructions " << stats.totalInstructions
+                      << " CPI " << stats.cyclesPerInstruction << " stalls " << stats.stalls
+                      << " MIPS " << (seconds > 0 ? stats.totalInstructions / seconds / 1e6 : 0) << std::endl;
+}
+
+void printUsage(const char *program)
+{
+    std::cerr << "Usage: " << program << " [--max-cycles N] [--max-instructions N] [--timeout SECONDS]"
+              << " [--progress FILE|-] [--progress-interval N] [--trace FILE|- | --check]"
+              << " [--sample cycles|instructions|raw-stalls|branches|memory=N]..." << std::endl;
+}
+
+// Define PIPELINED_PROCESSOR_LIBRARY before including this file to embed the simulator without its main().
+#ifndef PIPELINED_PROCESSOR_LIBRARY
+int main(int argc, char **argv)
+{
+    long long maxCycles = 0, maxInstructions = 0, progressInterval = 100000;
+    long long samplePeriods[NUM_SAMPLE_EVENTS] = {0};
+    bool check = false;
+    double timeLimit = 0;
+    const char *progressFile = 0, *traceFile = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 < argc && !std::strcmp(argv[i], "--max-cycles"))
+            maxCycles = std::atoll(argv[++i]);
+        else if (i + 1 < argc && !std::strcmp(argv[i], "--max-instructions"))
+            maxInstructions = std::atoll(argv[++i]);
+        else if (i + 1 < argc && !std::strcmp(argv[i], "--timeout"))
+            timeLimit = std::atof(argv[++i]);
+        else if (i + 1 < argc && !std::strcmp(argv[i], "--progress"))
+            progressFile = argv[++i];
+        else if (i + 1 < argc && !std::strcmp(argv[i], "--progress-interval"))
+            progressInterval = std::atoll(argv[++i]);
+        else if (i + 1 < argc && !std::strcmp(argv[i], "--trace"))
+            traceFile = argv[++i];
+        else if (!std::strcmp(argv[i], "--check"))
+            check = true;
+        else if (i + 1 < argc && !std::strcmp(argv[i], "--sample") && std::strchr(argv[i + 1], '='))
+        {
+            const char *sample = argv[++i], *period = std::strchr(sample, '=') + 1;
+            int event = 0;
+            while (event < NUM_SAMPLE_EVENTS && std::strncmp(sample, SAMPLE_EVENT_NAMES[event], period - 1 - sample))
+                ++event;
+            if (event == NUM_SAMPLE_EVENTS || (int)std::strlen(SAMPLE_EVENT_NAMES[event]) != period - 1 - sample)
+            {
+                std::cerr << "Unknown sample event in " << sample << std::endl;
+                return 1;
+            }
+            samplePeriods[event] = std::atoll(period);
+            if (samplePeriods[event] < 0)
+            {
+                printUsage(argv[0]);
+                return 1;
+            }
+        }
+        else
+        {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
     PipelinedProcessor simulator;
+    simulator.setBudget(maxCycles, maxInstructions, timeLimit);
+
+    if (traceFile && check)
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    std::ifstream traceInput;
+    if (traceFile)
+    {
+        if (std::strcmp(traceFile, "-"))
+        {
+            traceInput.open(traceFile);
+            if (!traceInput)
+            {
+                std::cerr << "Cannot open trace " << traceFile << std::endl;
+                return 1;
+            }
+            simulator.useTrace(traceInput);
+        }
+        else
+            simulator.useTrace(std::cin);
+    }
+    else if (check)
+        simulator.enableChecker();
+
+    for (int i = 0; i < NUM_SAMPLE_EVENTS; i++)
+        if (samplePeriods[i])
+            simulator.setSamplePeriod(i, samplePeriods[i]);
+
+    std::ofstream progressOutput;
+    ProgressStream progress = {&std::cout, std::chrono::steady_clock::now()};
+    if (progressFile)
+    {
+        if (std::strcmp(progressFile, "-"))
+        {
+            progressOutput.open(progressFile, std::ios::app);
+            progress.output = &progressOutput;
+        }
+        simulator.setStatisticsCallback(writeProgress, &progress, progressInterval);
+    }
 
     simulator.simulate();
     simulator.printOutputs();
+
+    if (simulator.terminationReason)
+    {
+        std::cerr << "Simulation terminated early: " << simulator.terminationReason << std::endl;
+        return 2;
+    }
 }
+#endif
@@ -0,0 +1,48 @@
+#!/bin/sh
+# Regression runs for the simulator: sh tests/regression.sh
+# Each case runs in a scratch directory whose input/ holds the case's files, falling back to the files in input/.
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+failures=0
+
+g++ "$ROOT/PipelinedProcessor.cpp" -o "$WORK/PipelinedProcessor.exe" || exit 1
+
+# run_case NAME STATUS PATTERN [ARGS...]: expects exit status STATUS and a line matching PATTERN in Output.txt
+run_case()
+{
+    name=$1 status=$2 pattern=$3
+    shift 3
+
+    rm -rf "$WORK/run" && mkdir -p "$WORK/run/input" "$WORK/run/output"
+    cp "$ROOT"/input/* "$WORK/run/input/"
+    [ -d "$ROOT/tests/$name" ] && cp "$ROOT/tests/$name"/* "$WORK/run/input/"
+
+    (cd "$WORK/run" && "$WORK/PipelinedProcessor.exe" "$@" 2>"$WORK/run/stderr.txt")
+    actual=$?
+
+    if [ "$actual" -ne "$status" ] || ! grep -q "$pattern" "$WORK/run/output/Output.txt"; then
+        echo "FAIL $name $*: exit status $actual, expected $status"
+        cat "$WORK/run/stderr.txt"
+        failures=$((failures + 1))
+    else
+        echo "ok   $name $*"
+    fi
+}
+
+run_case sample 0 "Cycles Per Instruction               : 2.25" --check
+if ! cmp -s "$WORK/run/output/ODCache.txt" "$ROOT/output/ODCache.txt" || ! cmp -s "$WORK/run/output/Output.txt" "$ROOT/output/Output.txt"; then
+    echo "FAIL sample: output differs from output/"
+    failures=$((failures + 1))
+fi
+
+# A program without HALT must stop cleanly on its budget, even after the PC has run off the instruction image.
+run_case no_halt 2 "Terminated early                     : cycle budget exhausted" --max-cycles 1000
+run_case no_halt 2 "Terminated early                     : cycle budget exhausted" --max-cycles 100000 --check
+
+# Trace-driven timing of the sample program matches its execution; a malformed record is an error, not end of trace.
+run_case trace 0 "Cycles Per Instruction               : 2.25" --trace input/trace.txt
+run_case trace_malformed 2 "Terminated early                     : malformed trace" --trace input/trace.txt
+
+[ "$failures" -eq 0 ]